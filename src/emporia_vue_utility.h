@@ -1,5 +1,6 @@
 #include "esphome.h"
 #include "sensor.h"
+#include "vue_metrics.h"
 
 // Extra meter reading response debugging
 #define DEBUG_VUE_RESPONSE true
@@ -41,6 +42,37 @@
 #define LED_PIN_LINK 32
 #define LED_PIN_WIFI 33
 
+// Serve the latest reading in Prometheus text format at this path.
+// Only active when the ESPHome "web_server:" component is configured.
+// The page is rebuilt when a new reading arrives or a counter changes,
+// so a scrape only copies an already formatted buffer.  The page
+// itself is formatted by vue_metrics.h.  This is not "/metrics" so
+// it does not clash with ESPHome's prometheus component.
+#define USE_METRICS_ENDPOINT true
+#define METRICS_PATH "/vue/metrics"
+#define METRICS_BUF_SIZE 2048
+
+#if USE_METRICS_ENDPOINT && defined(USE_WEBSERVER)
+#define METRICS_ENABLED 1
+#else
+#define METRICS_ENABLED 0
+#endif
+
+#if METRICS_ENABLED
+class EmporiaVueUtility;
+
+// Answers GET requests for METRICS_PATH from the async web server task
+class EmporiaVueMetricsHandler : public AsyncWebHandler {
+    public:
+        EmporiaVueMetricsHandler(EmporiaVueUtility *parent): parent_(parent) {}
+        bool canHandle(AsyncWebServerRequest *request) override;
+        void handleRequest(AsyncWebServerRequest *request) override;
+        bool isRequestHandlerTrivial() override { return true; }
+    protected:
+        EmporiaVueUtility *parent_;
+};
+#endif
+
 class EmporiaVueUtility : public Component,  public UARTDevice {
     public:
         EmporiaVueUtility(UARTComponent *parent): UARTDevice(parent) {}
@@ -115,6 +147,32 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
         // The most recent cost unit
         uint16_t cost_unit = 0;
 
+        // Counters for deriving consumed and returned separately
+        uint32_t consumed = 0;
+        uint32_t returned = 0;
+
+        // The most recent decoded values, as published to the sensors
+        float last_watt_hours = 0;
+        float last_watts = 0;
+
+        // Counters exposed on the metrics endpoint
+        uint32_t readings_total = 0;
+        uint32_t reading_errors_total = 0;
+        uint32_t parse_errors_total = 0;
+        uint32_t unhandled_responses_total = 0;
+        uint32_t meter_joins_total = 0;
+
+#if METRICS_ENABLED
+        // loop() formats into metrics_page and the web server task
+        // copies it into a response, both while holding metrics_lock
+        char metrics_page[METRICS_BUF_SIZE];
+        size_t metrics_page_len = 0;
+        SemaphoreHandle_t metrics_lock = NULL;
+
+        // Sum of the error counters when the page was last built
+        uint32_t metrics_built_counters = 0;
+#endif
+
         // Turn the wifi led on/off
         void led_wifi(bool state) {
 #if USE_LED_PINS
@@ -174,6 +232,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                     case 0:
                         if (c != 0x24 ) { // 0x24 == "$", the start of a message
                             ESP_LOGE(TAG, "Invalid input at position %d: 0x%x", pos, c);
+                            parse_errors_total++;
                             dump_serial_input(true);
                             pos = 0;
                             return 0;
@@ -182,6 +241,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                     case 1:
                         if (c != 0x01 ) { // 0x01 means "response"
                             ESP_LOGE(TAG, "Invalid input at position %d 0x%x", pos, c);
+                            parse_errors_total++;
                             dump_serial_input(true);
                             pos = 0;
                             return 0;
@@ -196,6 +256,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         break;
                     case sizeof(input_buffer.data) - 1:
                         ESP_LOGE(TAG, "Buffer overrun");
+                        parse_errors_total++;
                         dump_serial_input(true);
                         return 0;
                     default:
@@ -207,6 +268,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         } else {
                             ESP_LOGE(TAG, "Invalid terminator at pos %d 0x%x", pos, c);
                             ESP_LOGE(TAG, "Following char is 0x%x", read());
+                            parse_errors_total++;
                             dump_serial_input(true);
                             return 0;
                         }
@@ -313,10 +375,6 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             static uint8_t  history_pos;
             static bool not_first_run;
 
-            // Counters for deriving consumed and returned separately
-            static uint32_t consumed;
-            static uint32_t returned;
-
             float   prev_wh;
 
             float   watt_hours;
@@ -390,6 +448,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             kWh_consumed->publish_state(float(consumed) / 1000.0);
             kWh_returned->publish_state(float(returned) / 1000.0);
             kWh_net->publish_state(watt_hours / 1000.0);
+            last_watt_hours = watt_hours;
 
             return(watt_hours);
         }
@@ -430,6 +489,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                 last_reading_has_error = 1;
             } else {
                 W->publish_state(watts);
+                last_watts = watts;
                 if (watts > 0) {
                   W_consumed->publish_state(watts);
                   W_returned->publish_state(0);
@@ -511,6 +571,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             ESP_LOGE(TAG, "You can also file a bug at");
             ESP_LOGE(TAG, "  https://forms.gle/duMdU2i7wWHdbK5TA");
             write_array(msg, sizeof(msg));
+            meter_joins_total++;
             led_wifi(false);
         }
 
@@ -545,6 +606,63 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             }
         }
 
+#if METRICS_ENABLED
+        // Rebuild the metrics page from the most recent values
+        void update_metrics() {
+            struct VueMetrics m;
+            int len;
+
+            m.have_reading        = (last_meter_reading != 0);
+            m.watts               = last_watts;
+            m.watt_hours          = last_watt_hours;
+            m.consumed_wh         = consumed;
+            m.returned_wh         = returned;
+            m.meter_div           = meter_div;
+            m.cost_unit           = cost_unit;
+            m.last_reading        = last_meter_reading;
+            m.firmware_ver        = mgm_firmware_ver;
+            m.mac_address         = mgm_mac_address;
+            m.readings            = readings_total;
+            m.reading_errors      = reading_errors_total;
+            m.parse_errors        = parse_errors_total;
+            m.unhandled_responses = unhandled_responses_total;
+            m.meter_joins         = meter_joins_total;
+
+            if (xSemaphoreTake(metrics_lock, portMAX_DELAY) != pdTRUE) {
+                return;
+            }
+            len = vue_format_metrics(metrics_page, sizeof(metrics_page), &m);
+            metrics_page_len = (len < 0) ? 0 : len;
+            xSemaphoreGive(metrics_lock);
+
+            if (len < 0) {
+                ESP_LOGE(TAG, "Metrics page does not fit in %d bytes", METRICS_BUF_SIZE);
+            }
+            metrics_built_counters = metrics_counters();
+        }
+
+        // Counters that can change while no readings are arriving
+        uint32_t metrics_counters() {
+            return parse_errors_total + unhandled_responses_total + meter_joins_total;
+        }
+
+        // Send the current metrics page, called from the web server task
+        void send_metrics(AsyncWebServerRequest *request) {
+            AsyncResponseStream *response;
+
+            if (xSemaphoreTake(metrics_lock, portMAX_DELAY) != pdTRUE) {
+                request->send(503);
+                return;
+            }
+            response = request->beginResponseStream("text/plain; version=0.0.4", metrics_page_len);
+            response->write((const uint8_t *) metrics_page, metrics_page_len);
+            xSemaphoreGive(metrics_lock);
+            request->send(response);
+        }
+#else
+        void update_metrics() {}
+#endif
+
         void setup() override {
 #if USE_LED_PINS
             pinMode(LED_PIN_LINK, OUTPUT);
@@ -553,11 +671,19 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             led_link(false);
             led_wifi(false);
             clear_serial_input();
+#if METRICS_ENABLED
+            metrics_lock = xSemaphoreCreateMutex();
+            update_metrics();
+            web_server_base::global_web_server_base->add_handler(new EmporiaVueMetricsHandler(this));
+#endif
         }
 
         void loop() override {
             static time_t next_meter_request;
             static time_t next_meter_join;
+#if METRICS_ENABLED
+            static time_t next_metrics_update;
+#endif
             static uint8_t startup_step;
             char msg_type = 0;
             size_t msg_len = 0;
@@ -576,6 +702,9 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                        (long long) (INITIAL_STARTUP_DELAY +
                                     METER_REJOIN_INTERVAL));
               next_meter_request = next_meter_join = 0;
+#if METRICS_ENABLED
+              next_metrics_update = 0;
+#endif
             }
 
             if (msg_len != 0) {
@@ -587,12 +716,15 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         led_link(true);
                         last_reading_has_error = 0;
                         handle_resp_meter_reading();
+                        readings_total++;
                         if (last_reading_has_error) {
+                            reading_errors_total++;
                             ask_for_bug_report();
                         } else {
                             last_meter_reading = now;
                             next_meter_join = now + METER_REJOIN_INTERVAL;
                         }
+                        update_metrics();
                         break;
                     case 'j': // Meter reading
                         handle_resp_meter_join();
@@ -604,6 +736,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         break;
                     case 'f':
                         if (!handle_resp_firmware_ver()) {
+                            update_metrics();
                             led_wifi(true);
                             if (startup_step == 0) {
                                 startup_step++;
@@ -614,6 +747,7 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         break;
                     case 'm': // Mac address
                         if (!handle_resp_mac_address()) {
+                            update_metrics();
                             led_wifi(true);
                             if (startup_step == 1) {
                                 startup_step++;
@@ -634,12 +768,23 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
                         break;
                     default:
                         ESP_LOGE(TAG, "Unhandled response type '%c'", msg_type);
+                        unhandled_responses_total++;
                         ESP_LOG_BUFFER_HEXDUMP(TAG, input_buffer.data, msg_len, ESP_LOG_ERROR);
                         break;
                 }
                 pos = 0;
             }
 
+#if METRICS_ENABLED
+            // Keep the error counters on the metrics page current while
+            // the meter is not returning readings
+            if ((now >= next_metrics_update)
+                    && (metrics_counters() != metrics_built_counters)) {
+                update_metrics();
+                next_metrics_update = now + METER_READING_INTERVAL;
+            }
+#endif
+
             if (now >= next_meter_request) {
 
                 // Handle initial startup delay 
@@ -668,3 +813,13 @@ class EmporiaVueUtility : public Component,  public UARTDevice {
             }
         }
 };
+
+#if METRICS_ENABLED
+inline bool EmporiaVueMetricsHandler::canHandle(AsyncWebServerRequest *request) {
+    return request->method() == HTTP_GET && request->url() == METRICS_PATH;
+}
+
+inline void EmporiaVueMetricsHandler::handleRequest(AsyncWebServerRequest *request) {
+    parent_->send_metrics(request);
+}
+#endif
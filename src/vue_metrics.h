@@ -0,0 +1,137 @@
+#pragma once
+
+// Prometheus text formatting for the metrics endpoint in
+// emporia_vue_utility.h.  This file only uses the C library so the
+// page can be compiled and checked on a regular computer.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Values shown on the metrics page
+struct VueMetrics {
+    bool     have_reading;        // false until the first good meter reading
+    float    watts;
+    float    watt_hours;
+    uint32_t consumed_wh;
+    uint32_t returned_wh;
+    uint8_t  meter_div;
+    uint16_t cost_unit;
+    long long last_reading;       // time() of the last good reading, 0 if none
+    int      firmware_ver;
+    const char *mac_address;
+    uint32_t readings;
+    uint32_t reading_errors;
+    uint32_t parse_errors;
+    uint32_t unhandled_responses;
+    uint32_t meter_joins;
+};
+
+// printf into buf at *pos, returns false once buf is full
+inline bool vue_metrics_append(char *buf, size_t size, size_t *pos, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    if (*pos >= size) return false;
+    va_start(args, fmt);
+    len = vsnprintf(buf + *pos, size - *pos, fmt, args);
+    va_end(args);
+    if (len < 0 || (size_t) len >= size - *pos) {
+        *pos = size;
+        return false;
+    }
+    *pos += len;
+    return true;
+}
+
+// Append a label value, escaping \, " and newline as the
+// Prometheus text format requires
+inline bool vue_metrics_append_label(char *buf, size_t size, size_t *pos, const char *value) {
+    for (; *value; value++) {
+        const char *out;
+        switch (*value) {
+            case '\\': out = "\\\\"; break;
+            case '"':  out = "\\\""; break;
+            case '\n': out = "\\n";  break;
+            default:
+                if (!vue_metrics_append(buf, size, pos, "%c", *value)) return false;
+                continue;
+        }
+        if (!vue_metrics_append(buf, size, pos, "%s", out)) return false;
+    }
+    return true;
+}
+
+// Format the metrics page into buf.  Returns the page length, or -1
+// if it does not fit in size bytes.  The power and energy gauges are
+// left out until the first good reading so a scraper never sees
+// placeholder zeros as data.
+inline int vue_format_metrics(char *buf, size_t size, const struct VueMetrics *m) {
+    size_t pos = 0;
+    bool ok = true;
+
+    if (m->have_reading) {
+        ok = ok && vue_metrics_append(buf, size, &pos,
+                "# HELP vue_power_watts Instant power from the last good reading, see vue_last_reading_timestamp_seconds for its age\n"
+                "# TYPE vue_power_watts gauge\n"
+                "vue_power_watts %.0f\n"
+                "# HELP vue_energy_net_watt_hours Net energy from the last good reading, see vue_last_reading_timestamp_seconds for its age\n"
+                "# TYPE vue_energy_net_watt_hours gauge\n"
+                "vue_energy_net_watt_hours %.0f\n",
+                m->watts,
+                m->watt_hours);
+    }
+
+    ok = ok && vue_metrics_append(buf, size, &pos,
+            "# HELP vue_energy_consumed_watt_hours_total Energy consumed from the grid since boot\n"
+            "# TYPE vue_energy_consumed_watt_hours_total counter\n"
+            "vue_energy_consumed_watt_hours_total %lu\n"
+            "# HELP vue_energy_returned_watt_hours_total Energy returned to the grid since boot\n"
+            "# TYPE vue_energy_returned_watt_hours_total counter\n"
+            "vue_energy_returned_watt_hours_total %lu\n"
+            "# HELP vue_meter_div Meter divisor, meter reading payload byte 47\n"
+            "# TYPE vue_meter_div gauge\n"
+            "vue_meter_div %u\n"
+            "# HELP vue_cost_unit Meter cost unit\n"
+            "# TYPE vue_cost_unit gauge\n"
+            "vue_cost_unit %u\n"
+            "# HELP vue_last_reading_timestamp_seconds Unix time of the last good meter reading, needs a time source\n"
+            "# TYPE vue_last_reading_timestamp_seconds gauge\n"
+            "vue_last_reading_timestamp_seconds %lld\n"
+            "# HELP vue_mgm_info MGM111 identity\n"
+            "# TYPE vue_mgm_info gauge\n"
+            "vue_mgm_info{firmware=\"%d\",mac=\"",
+            (unsigned long) m->consumed_wh,
+            (unsigned long) m->returned_wh,
+            (unsigned) m->meter_div,
+            (unsigned) m->cost_unit,
+            m->last_reading,
+            m->firmware_ver);
+    ok = ok && vue_metrics_append_label(buf, size, &pos, m->mac_address);
+    ok = ok && vue_metrics_append(buf, size, &pos,
+            "\"} 1\n"
+            "# HELP vue_readings_total Meter reading responses received, including rejected ones\n"
+            "# TYPE vue_readings_total counter\n"
+            "vue_readings_total %lu\n"
+            "# HELP vue_reading_errors_total Meter readings rejected as invalid\n"
+            "# TYPE vue_reading_errors_total counter\n"
+            "vue_reading_errors_total %lu\n"
+            "# HELP vue_parse_errors_total Malformed messages from the MGM111\n"
+            "# TYPE vue_parse_errors_total counter\n"
+            "vue_parse_errors_total %lu\n"
+            "# HELP vue_unhandled_responses_total Responses of an unknown type\n"
+            "# TYPE vue_unhandled_responses_total counter\n"
+            "vue_unhandled_responses_total %lu\n"
+            "# HELP vue_meter_joins_total Meter join attempts\n"
+            "# TYPE vue_meter_joins_total counter\n"
+            "vue_meter_joins_total %lu\n",
+            (unsigned long) m->readings,
+            (unsigned long) m->reading_errors,
+            (unsigned long) m->parse_errors,
+            (unsigned long) m->unhandled_responses,
+            (unsigned long) m->meter_joins);
+
+    if (!ok) return -1;
+    return pos;
+}